@@ -0,0 +1,305 @@
+/**
+ * smbbench.c
+ * Simple message broker benchmark that floods a low priority topic and measures how long subscribe requests and
+ * messages on a high priority topic take meanwhile. The broker should be started with
+ * '-p bench/alarm=0 -p bench/bulk=3'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define SERVER_PORT 8080
+#define CONTROL_PORT 8081
+#define MSG_BUF_SIZE 4096
+#define ACK 'A'                 // Used as the start of an ACKNOWLEDGE message
+#define SUB 'S'                 // Used as the start of a SUBSCRIBE message
+#define SOH '\x01'              // Start of heading control char: Used to start a publish request message
+#define STX '\x02'              // Start of text control char: Used to separate topic and message
+#define BULK_TOPIC "bench/bulk" // Low priority topic that is flooded
+#define ALARM_TOPIC "bench/alarm" // High priority topic whose latency is measured
+#define DEFAULT_BURST 2000      // Number of bulk messages sent in the burst phase
+#define DEFAULT_SECS 3          // Duration of the saturation phase
+#define PROBE_INTERVAL_MS 10    // Pause between two probes in the saturation phase
+#define TIMEOUT_MS 1000         // Time after which a probe counts as lost or the broker as idle
+#define MAX_PROBES 10000
+#define RCV_BUF_SIZE (8 * 1024 * 1024)
+
+/**
+ * Prints usage information
+ */
+void print_usage(char *argv[]) {
+    printf("Usage: '%s broker [burst_count] [seconds]'\n\n"
+           "Start the broker with '-p %s=0 -p %s=3'. The benchmark first sends burst_count (default %d) messages on '%s'\n"
+           "followed by one on '%s', then floods '%s' for the given number of seconds (default %d) while measuring\n"
+           "how long new subscriptions and messages on '%s' take.\n",
+           argv[0], ALARM_TOPIC, BULK_TOPIC, DEFAULT_BURST, BULK_TOPIC, ALARM_TOPIC, BULK_TOPIC, DEFAULT_SECS, ALARM_TOPIC);
+}
+
+/**
+ * Resolves a hostname or IP address string to the corresponding internet socket address.
+ *
+ * @param hostname The hostname or IP to resolve
+ * @return The internet socket address struct
+ */
+struct sockaddr_in* resolve_hostname(char *hostname) {
+    struct addrinfo hints;
+    struct addrinfo *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    int errcode = getaddrinfo(hostname, NULL, &hints, &res);
+    if (errcode != 0) {
+        fprintf(stderr, "getaddrinfo: %s", gai_strerror(errcode));
+        exit(EXIT_FAILURE);
+    }
+
+    return (struct sockaddr_in *) res->ai_addr;
+}
+
+/**
+ * Checks the args for validity and saves them in the corresponding variables.
+ */
+void validate_args(int argc, char *argv[], char **hostname, int *burst, int *secs) {
+    if (argc == 1) {
+        print_usage(argv);
+        exit(EXIT_SUCCESS);
+    }
+
+    *hostname = argv[1];
+    *burst = argc > 2 ? atoi(argv[2]) : DEFAULT_BURST;
+    *secs = argc > 3 ? atoi(argv[3]) : DEFAULT_SECS;
+
+    if (*burst <= 0 || *secs <= 0) {
+        fprintf(stderr, "burst_count and seconds must be positive.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Returns the current time of the monotonic clock in milliseconds.
+ */
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Creates a UDP socket with a large receive buffer, so the benchmark itself doesn't lose relayed messages.
+ */
+int create_socket() {
+    int rcv_buf_size = RCV_BUF_SIZE;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        exit(EXIT_FAILURE);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv_buf_size, sizeof(rcv_buf_size));
+    return fd;
+}
+
+/**
+ * Sends a message to the given broker port.
+ */
+void send_msg(int fd, struct sockaddr_in *broker_addr, uint16_t port, char *msg) {
+    struct sockaddr_in addr = *broker_addr;
+    addr.sin_port = htons(port);
+    if (sendto(fd, msg, strlen(msg), 0, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("sendto");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Reads all datagrams waiting on the bulk socket without blocking.
+ *
+ * @return The number of datagrams read
+ */
+long drain(int bulk_fd) {
+    char buf[MSG_BUF_SIZE];
+    long n = 0;
+    while (recv(bulk_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) n++;
+    return n;
+}
+
+/**
+ * Waits for a message on fd, counting all bulk messages received meanwhile.
+ *
+ * @param fd The socket to wait on or -1 to only count bulk messages until the timeout
+ * @param bulk_fd The socket subscribed to the bulk topic or -1 if it isn't subscribed yet
+ * @param expected The message to wait for, other messages on fd are ignored
+ * @param timeout_ms The time to wait at most
+ * @param bulk_c Incremented by the number of bulk messages received meanwhile
+ * @return 1 if the expected message was received, 0 on timeout
+ */
+int wait_for(int fd, int bulk_fd, char *expected, double timeout_ms, long *bulk_c) {
+    char buf[MSG_BUF_SIZE];
+    struct pollfd fds[2] = {{bulk_fd, POLLIN, 0}, {fd, POLLIN, 0}}; // poll ignores negative fds
+    double deadline = now_ms() + timeout_ms;
+    ssize_t nbytes;
+
+    while (now_ms() < deadline) {
+        if (poll(fds, 2, (int) (deadline - now_ms()) + 1) <= 0) continue;
+
+        if (fds[1].revents & POLLIN) {
+            nbytes = recv(fd, buf, sizeof(buf) - 1, 0);
+            if (nbytes > 0) {
+                buf[nbytes] = '\0';
+                if (expected && strcmp(buf, expected) == 0) return 1;
+            }
+        }
+        if (fds[0].revents & POLLIN) *bulk_c += drain(bulk_fd);
+    }
+    return 0;
+}
+
+/**
+ * Counts bulk messages until none arrived for TIMEOUT_MS.
+ */
+void drain_until_idle(int bulk_fd, long *bulk_c) {
+    long before;
+    do {
+        before = *bulk_c;
+        wait_for(-1, bulk_fd, NULL, TIMEOUT_MS, bulk_c);
+    } while (*bulk_c != before);
+}
+
+/**
+ * Subscribes a socket to a topic via the control port.
+ *
+ * @return The time until the acknowledgement arrived in milliseconds or -1 if it didn't arrive in time
+ */
+double subscribe(int fd, int bulk_fd, struct sockaddr_in *broker_addr, char *topic, long *bulk_c) {
+    char msg[MSG_BUF_SIZE], ack[MSG_BUF_SIZE];
+    double start = now_ms();
+
+    snprintf(msg, sizeof(msg), "%c%s", SUB, topic);
+    snprintf(ack, sizeof(ack), "%c%s", ACK, topic);
+    send_msg(fd, broker_addr, CONTROL_PORT, msg);
+    if (!wait_for(fd, bulk_fd, ack, TIMEOUT_MS, bulk_c)) return -1;
+    return now_ms() - start;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints p50, p99 and max of the given latencies.
+ */
+void print_latencies(char *name, double *latencies, int n, int lost) {
+    if (n == 0) {
+        printf("%s: no samples, %d lost\n", name, lost);
+        return;
+    }
+    qsort(latencies, n, sizeof(latencies[0]), compare_double);
+    printf("%s: p50 %.3f ms, p99 %.3f ms, max %.3f ms over %d samples, %d lost\n",
+           name, latencies[n / 2], latencies[n * 99 / 100], latencies[n - 1], n, lost);
+}
+
+int main(int argc, char *argv[]) {
+    char buf[MSG_BUF_SIZE], expected[MSG_BUF_SIZE];
+    static double sub_latencies[MAX_PROBES], alarm_latencies[MAX_PROBES];
+    struct sockaddr_in broker_addr;
+    char *hostname;
+    int burst, secs, pub_fd, bulk_fd, alarm_fd, pipe_fds[2];
+    int probes = 0, sub_c = 0, sub_lost = 0, alarm_c = 0, alarm_lost = 0;
+    long bulk_c = 0, bulk_sent = 0;
+    double start, deadline;
+    pid_t flooder;
+
+    validate_args(argc, argv, &hostname, &burst, &secs);
+    broker_addr = *resolve_hostname(hostname);
+
+    pub_fd = create_socket();
+    bulk_fd = create_socket();
+    alarm_fd = create_socket();
+
+    if (subscribe(bulk_fd, -1, &broker_addr, BULK_TOPIC, &bulk_c) < 0
+        || subscribe(alarm_fd, bulk_fd, &broker_addr, ALARM_TOPIC, &bulk_c) < 0) {
+        fprintf(stderr, "Broker didn't acknowledge the subscriptions.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Burst: The alarm is sent right behind the bulk messages and should overtake them in the broker.
+    snprintf(buf, sizeof(buf), "%c%s%cburst", SOH, BULK_TOPIC, STX);
+    for (int i = 0; i < burst; ++i) send_msg(pub_fd, &broker_addr, SERVER_PORT, buf);
+    snprintf(expected, sizeof(expected), "%c%s%cburst", SOH, ALARM_TOPIC, STX);
+    start = now_ms();
+    send_msg(pub_fd, &broker_addr, SERVER_PORT, expected);
+
+    bulk_c = 0;
+    if (wait_for(alarm_fd, bulk_fd, expected, TIMEOUT_MS, &bulk_c)) {
+        printf("burst: alarm relayed after %.3f ms, behind %ld of %d bulk messages\n", now_ms() - start, bulk_c, burst);
+    } else {
+        printf("burst: alarm lost\n");
+    }
+    drain_until_idle(bulk_fd, &bulk_c);
+    printf("burst: %ld of %d bulk messages delivered\n", bulk_c, burst);
+
+    // Saturation: A child process floods the bulk topic while new subscriptions and alarms are timed.
+    if (pipe(pipe_fds) < 0) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    deadline = now_ms() + secs * 1e3;
+    fflush(stdout); // Otherwise the child prints the buffered output again on exit
+    flooder = fork();
+    if (flooder == 0) {
+        snprintf(buf, sizeof(buf), "%c%s%cflood", SOH, BULK_TOPIC, STX);
+        while (now_ms() < deadline) {
+            send_msg(pub_fd, &broker_addr, SERVER_PORT, buf);
+            bulk_sent++;
+        }
+        write(pipe_fds[1], &bulk_sent, sizeof(bulk_sent));
+        exit(EXIT_SUCCESS);
+    }
+
+    bulk_c = 0;
+    while (now_ms() < deadline && probes < MAX_PROBES) {
+        int fd = create_socket();
+        char topic[MSG_BUF_SIZE];
+        double latency;
+
+        snprintf(topic, sizeof(topic), "bench/sub%d", probes);
+        latency = subscribe(fd, bulk_fd, &broker_addr, topic, &bulk_c);
+        if (latency < 0) {
+            sub_lost++;
+        } else {
+            sub_latencies[sub_c++] = latency;
+        }
+        close(fd);
+
+        snprintf(expected, sizeof(expected), "%c%s%c%d", SOH, ALARM_TOPIC, STX, probes);
+        start = now_ms();
+        send_msg(pub_fd, &broker_addr, SERVER_PORT, expected);
+        if (wait_for(alarm_fd, bulk_fd, expected, TIMEOUT_MS, &bulk_c)) {
+            alarm_latencies[alarm_c++] = now_ms() - start;
+        } else {
+            alarm_lost++;
+        }
+
+        probes++;
+        wait_for(-1, bulk_fd, NULL, PROBE_INTERVAL_MS, &bulk_c);
+    }
+
+    waitpid(flooder, NULL, 0);
+    read(pipe_fds[0], &bulk_sent, sizeof(bulk_sent));
+    drain_until_idle(bulk_fd, &bulk_c);
+
+    print_latencies("saturation: subscribe", sub_latencies, sub_c, sub_lost);
+    print_latencies("saturation: alarm", alarm_latencies, alarm_c, alarm_lost);
+    printf("saturation: %ld of %ld bulk messages delivered\n", bulk_c, bulk_sent);
+
+    return EXIT_SUCCESS;
+}
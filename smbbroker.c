@@ -3,13 +3,24 @@
  * Simple message broker that listens for publish requests and relays the messages to it's subscribers.
  */
 
+#define _GNU_SOURCE             // Needed for sched_setaffinity
+
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #define SERVER_PORT 8080
+#define CONTROL_PORT 8081       // Dedicated port for SUBSCRIBE requests and their acknowledgements
 #define MSG_BUF_SIZE 4096
 #define MAX_SUBSCRIBERS 512
 #define MAX_TOPIC_LEN 512
@@ -18,7 +29,27 @@
 #define SOH '\x01'              // Start of heading control char: Used to start a publish request message
 #define STX '\x02'              // Start of text control char: Used to separate topic and message
 #define TOPIC_SEPARATOR '/'     // Used to separate topic and subtopic
+#define PRIO_SEPARATOR '='      // Used to separate topic and priority class in the -p option
 #define WILD_CARD "#"
+#define NUM_PRIO_CLASSES 4      // Number of priority classes for publish requests (0 is the highest)
+#define DEFAULT_PRIO_CLASS 2    // Priority class of topics without a matching priority rule
+#define MAX_PRIO_RULES 64
+#define DATA_RCV_BUF_SIZE (4 * 1024 * 1024) // Requested receive buffer of the data socket, capped by net.core.rmem_max
+#define MAX_QUEUED_BYTES (16 * 1024 * 1024) // Max memory of pending publish requests of all priority classes
+#define INGEST_BATCH 256        // Max number of datagrams read from the data socket per scheduler round
+#define CONTROL_BATCH 64        // Max number of control requests handled per scheduler round
+#define DROP_REPORT_INTERVAL 1000
+#define BUSY_POLL_USECS 50      // Time the kernel busy polls the device queue per receive in low-latency mode
+#define PREFAULT_STACK_SIZE (512 * 1024)
+#define DWELL_SAMPLES 10000     // Min number of dwell time samples per latency report
+#define DWELL_SUB_BUCKETS 16    // Histogram buckets per power of two, limits the error of reported dwell times to 1/16
+#define DWELL_BUCKETS (61 * DWELL_SUB_BUCKETS)
+
+// Number of publish requests relayed per scheduler round for each priority class. Higher classes are served first,
+// but every backlogged class gets its share each round. Shares of classes with nothing queued go to the classes that
+// still have requests queued, so a round always relays ROUND_BUDGET requests if there are enough of them.
+static const int class_weights[NUM_PRIO_CLASSES] = {8, 4, 2, 1};
+#define ROUND_BUDGET 15         // Sum of class_weights: Max number of relays before the sockets are checked again
 
 // Struct represents a subscription of a single client
 struct subscription {
@@ -28,6 +59,61 @@ struct subscription {
     char subtopic[MAX_TOPIC_LEN + 1];   // Subtopic subscribed to
 } sub_list[MAX_SUBSCRIBERS];            // List of subscribers
 
+int sub_c = 0; // Counts the number of subscribed clients
+
+// Struct represents a rule assigning a topic and subtopic (or wildcards) to a priority class
+struct prio_rule {
+    char topic[MAX_TOPIC_LEN + 1];
+    char subtopic[MAX_TOPIC_LEN + 1];
+    int prio_class;
+} prio_rules[MAX_PRIO_RULES];           // List of priority rules, the first matching rule wins
+
+int rule_c = 0; // Counts the number of priority rules
+
+int low_latency = 0;    // Busy poll instead of blocking and don't log every single message
+int cpu_core = -1;      // Core the broker is pinned to or -1 if it isn't pinned
+
+// Struct represents a received publish request waiting to be relayed
+struct publish_request {
+    struct publish_request *next;       // Next request in the same queue
+    struct sockaddr_in src_addr;        // Address of the publishing client
+    struct timespec rx_ts;              // Kernel receive timestamp or zero if none was delivered
+    size_t len;                         // Length of the received datagram
+    char *topic, *subtopic, *msg;       // Pointers into buf
+    char buf[];                         // Received datagram, split in place
+};
+
+// Struct represents a FIFO list of pending publish requests of a single priority class
+struct publish_queue {
+    struct publish_request *head;       // Oldest pending request
+    struct publish_request *tail;       // Newest pending request
+    unsigned int count;                 // Number of pending requests
+    unsigned long dropped;              // Number of requests dropped because MAX_QUEUED_BYTES was reached
+} publish_queues[NUM_PRIO_CLASSES];     // One queue per priority class
+
+size_t queued_bytes = 0; // Memory of all pending publish requests
+
+// Histogram of dwell times (kernel receive to relayed to all subscribers) in nanoseconds. Recording a sample is O(1),
+// the report is only printed once DWELL_SAMPLES are collected and no publish requests are pending.
+uint64_t dwell_hist[DWELL_BUCKETS];
+uint64_t dwell_min = UINT64_MAX, dwell_max = 0;
+unsigned int dwell_c = 0;
+
+/**
+ * Prints usage information
+ */
+void print_usage(char *argv[]) {
+    printf("Usage: '%s [-l] [-c core] [-p topic%csubtopic%cclass]...'\n\n"
+           "  -l  Low-latency mode: busy poll the sockets, lock all memory and only log dwell time reports\n"
+           "  -c  Pin the broker to the given CPU core\n"
+           "  -p  Assign a topic and subtopic to a priority class\n\n"
+           "Publish requests are relayed according to their priority class (0 is the highest, %d the lowest).\n"
+           "Topics without a matching rule use class %d. Wildcards ('%s') are supported for topics and subtopics.\n"
+           "Subscribe requests are accepted on port %d (data) and port %d (control, served before any data).\n",
+           argv[0], TOPIC_SEPARATOR, PRIO_SEPARATOR, NUM_PRIO_CLASSES - 1, DEFAULT_PRIO_CLASS, WILD_CARD,
+           SERVER_PORT, CONTROL_PORT);
+}
+
 /**
  * Splits a string in two by replacing the first occurrence of sep with '\0'.
  *
@@ -42,140 +128,673 @@ char *spilt_at(char *str, char sep) {
     return sep_ptr + 1;
 }
 
-int main() {
-    char rcv_buf[MSG_BUF_SIZE], send_buf[MSG_BUF_SIZE];
-    char cmd, *msg_ptr, *topic, *subtopic;
-    int sub_c = 0; // Counts the number of subscribed clients
-    int broker_fd;
-    struct sockaddr_in server_addr, client_addr;
-    int errcode;
-    uint addr_length;
-    uint32_t msg_len;
-    ssize_t nbytes;
+/**
+ * Checks if a topic or subtopic matches a pattern.
+ *
+ * @param pattern The subscribed topic or subtopic (may be the wildcard)
+ * @param topic The topic or subtopic to check
+ * @return 1 if the topic matches the pattern, 0 otherwise
+ */
+int topic_matches(const char *pattern, const char *topic) {
+    return strcmp(pattern, topic) == 0 || strcmp(pattern, WILD_CARD) == 0;
+}
+
+/**
+ * Checks the args for validity and fills the list of priority rules.
+ */
+void validate_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        char *topic, *subtopic, *prio, *end;
+        struct prio_rule *rule;
+        long prio_class;
+
+        if (strcmp(argv[i], "-l") == 0) {
+            low_latency = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            long core = strtol(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0' || core < 0 || core >= CPU_SETSIZE) {
+                fprintf(stderr, "Invalid CPU core '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            cpu_core = (int) core;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-p") != 0 || i + 1 >= argc) {
+            print_usage(argv);
+            exit(strcmp(argv[i], "-h") == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
 
-    // Create broker socket
-    broker_fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (broker_fd < 0) {
-        perror("vlftpd: Error creating socket");
-        return EXIT_FAILURE;
+        if (rule_c >= MAX_PRIO_RULES) {
+            fprintf(stderr, "Too many priority rules! Max number is %d.\n", MAX_PRIO_RULES);
+            exit(EXIT_FAILURE);
+        }
+
+        topic = argv[++i];
+        if (!(prio = spilt_at(topic, PRIO_SEPARATOR))) {
+            fprintf(stderr, "You need to provide a priority class seperated with '%c'\n", PRIO_SEPARATOR);
+            exit(EXIT_FAILURE);
+        }
+        if (!(subtopic = spilt_at(topic, TOPIC_SEPARATOR))) {
+            // If only the main topic was provided without a separator implicitly set subtopic to wildcard
+            subtopic = WILD_CARD;
+        }
+
+        prio_class = strtol(prio, &end, 10);
+        if (*prio == '\0' || *end != '\0' || prio_class < 0 || prio_class >= NUM_PRIO_CLASSES) {
+            fprintf(stderr, "Invalid priority class '%s'. Must be between 0 and %d.\n", prio, NUM_PRIO_CLASSES - 1);
+            exit(EXIT_FAILURE);
+        }
+
+        int t;
+        if ((t = strlen(topic) > MAX_TOPIC_LEN) || strlen(subtopic) > MAX_TOPIC_LEN) {
+            fprintf(stderr, "%s to long! Max length is %d.\n", t ? "Topic" : "Subtopic", MAX_TOPIC_LEN);
+            exit(EXIT_FAILURE);
+        }
+
+        if ((t = strcmp(topic, "") == 0) || strcmp(subtopic, "") == 0) {
+            fprintf(stderr, "%s can't be empty.\n", t ? "Topic" : "Subtopic");
+            exit(EXIT_FAILURE);
+        }
+
+        rule = &prio_rules[rule_c++];
+        snprintf(rule->topic, sizeof(rule->topic), "%s", topic);
+        snprintf(rule->subtopic, sizeof(rule->subtopic), "%s", subtopic);
+        rule->prio_class = (int) prio_class;
     }
+}
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    memset(&client_addr, 0, sizeof(client_addr));
+/**
+ * Creates a UDP socket bound to the given port on any address.
+ *
+ * @param port The port to bind to
+ * @return The socket file descriptor. Exits the program on failure.
+ */
+int create_socket(uint16_t port) {
+    struct sockaddr_in server_addr;
+    int fd, errcode;
 
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("smbbroker: Error creating socket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY; // Set the address struct to accepts connections from any address
-    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_port = htons(port);
 
     // Bind socket to port
-    errcode = bind(broker_fd, (const struct sockaddr *) &server_addr, sizeof(server_addr));
+    errcode = bind(fd, (const struct sockaddr *) &server_addr, sizeof(server_addr));
     if (errcode < 0) {
         perror("smbbroker: Failed to bind socket");
-        return EXIT_FAILURE;
+        exit(EXIT_FAILURE);
+    }
+
+    if (low_latency) {
+        // Raising the busy poll time above net.core.busy_read needs CAP_NET_ADMIN. Without it we still spin in user space.
+        int usecs = BUSY_POLL_USECS;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+            perror("smbbroker: Warning: Failed to enable busy polling");
+        }
     }
 
-    printf("smbbroker: Listening on port %d\n", SERVER_PORT);
+    return fd;
+}
 
-    addr_length = sizeof(client_addr);
-    while(1) { // Continuously listen for subscribing or publish requests...
+/**
+ * Enables kernel receive timestamps on a socket. These are taken when the datagram enters the network stack,
+ * so the dwell time includes the time spent in the socket buffer waiting for the broker.
+ *
+ * @param fd The socket
+ */
+void enable_rx_timestamps(int fd) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        perror("smbbroker: Warning: Failed to enable receive timestamps");
+    }
+}
+
+/**
+ * Touches the stack so its pages are mapped before mlockall, preventing page faults on the hot path.
+ */
+void prefault_stack(void) {
+    volatile char stack[PREFAULT_STACK_SIZE];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * Pins the broker to the configured core and, in low-latency mode, locks all current and future memory.
+ * MCL_FUTURE also covers the publish requests allocated later, as long as they fit into RLIMIT_MEMLOCK.
+ */
+void setup_low_latency(void) {
+    if (cpu_core >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu_core, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            perror("smbbroker: Failed to pin broker to CPU core");
+            exit(EXIT_FAILURE);
+        }
+        printf("smbbroker: Pinned to CPU core %d\n", cpu_core);
+    }
+
+    if (low_latency) {
+        prefault_stack();
+        // MCL_CURRENT also faults in all mapped pages, including the static subscription list and dwell histogram.
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            perror("smbbroker: Warning: Failed to lock memory (check RLIMIT_MEMLOCK)");
+        }
+        printf("smbbroker: Low-latency mode enabled\n");
+    }
+}
+
+/**
+ * Returns the histogram bucket of a dwell time. Values below DWELL_SUB_BUCKETS get their own bucket, larger values
+ * share DWELL_SUB_BUCKETS buckets per power of two.
+ *
+ * @param dwell The dwell time in nanoseconds
+ * @return The index of the bucket
+ */
+int dwell_bucket(uint64_t dwell) {
+    int msb;
+
+    if (dwell < DWELL_SUB_BUCKETS) return (int) dwell;
+    msb = 63 - __builtin_clzll(dwell);
+    return (msb - 3) * DWELL_SUB_BUCKETS + (int) ((dwell >> (msb - 4)) & (DWELL_SUB_BUCKETS - 1));
+}
+
+/**
+ * Returns the smallest dwell time in a histogram bucket.
+ *
+ * @param bucket The index of the bucket
+ * @return The smallest dwell time in nanoseconds that falls into the bucket
+ */
+uint64_t dwell_bucket_start(int bucket) {
+    if (bucket < DWELL_SUB_BUCKETS) return (uint64_t) bucket;
+    return (uint64_t) (DWELL_SUB_BUCKETS + bucket % DWELL_SUB_BUCKETS) << (bucket / DWELL_SUB_BUCKETS - 1);
+}
+
+/**
+ * Returns a percentile of the recorded dwell times as the upper bound of the bucket it falls into.
+ *
+ * @param percentile The percentile between 0 and 1
+ * @return The dwell time in nanoseconds
+ */
+uint64_t dwell_percentile(double percentile) {
+    uint64_t rank = (uint64_t) (percentile * dwell_c), seen = 0;
+
+    for (int b = 0; b < DWELL_BUCKETS; ++b) {
+        seen += dwell_hist[b];
+        if (seen > rank) {
+            uint64_t end = b + 1 < DWELL_BUCKETS ? dwell_bucket_start(b + 1) - 1 : UINT64_MAX;
+            return end < dwell_max ? end : dwell_max;
+        }
+    }
+    return dwell_max;
+}
+
+/**
+ * Prints a latency report of the recorded dwell times and resets the histogram.
+ * Should only be called while no publish requests are pending, so the report doesn't delay any relay.
+ */
+void report_dwell(void) {
+    printf("smbbroker: Dwell time over %u messages: min %" PRIu64 " ns, p50 %" PRIu64 " ns, p99 %" PRIu64 " ns, p99.9 %" PRIu64 " ns, max %" PRIu64 " ns\n",
+           dwell_c, dwell_min, dwell_percentile(0.5), dwell_percentile(0.99), dwell_percentile(0.999), dwell_max);
+    fflush(stdout);
+
+    memset(dwell_hist, 0, sizeof(dwell_hist));
+    dwell_min = UINT64_MAX;
+    dwell_max = 0;
+    dwell_c = 0;
+}
+
+/**
+ * Records the dwell time of a relayed publish request in the histogram.
+ *
+ * @param req The relayed publish request
+ * @return The dwell time in nanoseconds or -1 if the request has no receive timestamp
+ */
+int64_t record_dwell(struct publish_request *req) {
+    struct timespec now;
+    int64_t dwell;
+
+    if (req->rx_ts.tv_sec == 0 && req->rx_ts.tv_nsec == 0) return -1;
+
+    // Software receive timestamps are taken from CLOCK_REALTIME
+    clock_gettime(CLOCK_REALTIME, &now);
+    dwell = (int64_t) (now.tv_sec - req->rx_ts.tv_sec) * 1000000000 + (now.tv_nsec - req->rx_ts.tv_nsec);
+    if (dwell < 0) return -1;
+
+    dwell_hist[dwell_bucket((uint64_t) dwell)]++;
+    if ((uint64_t) dwell < dwell_min) dwell_min = (uint64_t) dwell;
+    if ((uint64_t) dwell > dwell_max) dwell_max = (uint64_t) dwell;
+    dwell_c++;
+
+    return dwell;
+}
+
+/**
+ * Returns the priority class of a topic and subtopic according to the priority rules.
+ *
+ * @param topic The topic of a publish request
+ * @param subtopic The subtopic of a publish request
+ * @return The priority class of the first matching rule or DEFAULT_PRIO_CLASS if no rule matches
+ */
+int get_prio_class(const char *topic, const char *subtopic) {
+    for (int r = 0; r < rule_c; ++r) {
+        struct prio_rule *rule = &prio_rules[r];
+        if (topic_matches(rule->topic, topic) && topic_matches(rule->subtopic, subtopic)) {
+            return rule->prio_class;
+        }
+    }
+    return DEFAULT_PRIO_CLASS;
+}
+
+/**
+ * Adds the client to the subscription list (if it isn't in the list yet) and acknowledges the subscription.
+ *
+ * @param fd The socket the request was received on. The acknowledgement is sent from the same socket.
+ * @param msg_ptr The SUBSCRIBE message without the command char
+ * @param client_addr The address of the subscribing client
+ */
+void handle_subscribe(int fd, char *msg_ptr, struct sockaddr_in *client_addr) {
+    char send_buf[MSG_BUF_SIZE];
+    char *topic, *subtopic;
+    struct subscription *sub;
+    uint8_t exists = 0;
+    uint32_t msg_len;
+    ssize_t nbytes;
+
+    // Go through the subscription list to check if the client of current request already is in the list.
+    for (int i = 0; i < sub_c; ++i) {
+        sub = &sub_list[i];
+        if (sub->sub_addr.s_addr == client_addr->sin_addr.s_addr && sub->port == ntohs(client_addr->sin_port)) {
+            exists = 1;
+            break;
+        }
+    }
+
+    // If the client is not in the list, add it.
+    if (!exists) {
+        if (sub_c >= MAX_SUBSCRIBERS) {
+            printf("smbbroker: Subscription list full. Ignoring subscribe request from %s:%d\n", inet_ntoa(client_addr->sin_addr),
+                   ntohs(client_addr->sin_port));
+            return;
+        }
+
+        sub = &sub_list[sub_c++];
+        sub->sub_addr = client_addr->sin_addr;
+        sub->port = ntohs(client_addr->sin_port);
+
+        topic = msg_ptr;
+        if (!(subtopic = spilt_at(msg_ptr, TOPIC_SEPARATOR))) {
+            subtopic = "#";
+        }
+
+        snprintf(sub->topic, sizeof(sub->topic), "%s", topic);
+        snprintf(sub->subtopic, sizeof(sub->subtopic), "%s", subtopic);
+        printf("smbbroker: Topic '%s%c%s' added to subscription list for new subscriber %s:%d\n", msg_ptr, TOPIC_SEPARATOR, subtopic, inet_ntoa(sub->sub_addr), sub->port);
+    } else {
+        printf("smbbroker: Subscriber %s:%d already in subscription list with topic '%s%c%s'. Sending acknowledge again...\n", inet_ntoa(sub->sub_addr), sub->port, sub->topic, TOPIC_SEPARATOR, sub->subtopic);
+    }
+
+    // In any case, we send an acknowledgement message to the client.
+    snprintf(send_buf, sizeof(send_buf), "%c%s%c%s", ACK, sub->topic, TOPIC_SEPARATOR, sub->subtopic);
+    msg_len = strlen(send_buf);
+
+    nbytes = sendto(fd, send_buf, msg_len, 0, (struct sockaddr *) client_addr, sizeof(*client_addr));
+    if (nbytes == -1) {
+        perror("smbbroker: sendto acknowledge");
+    } else if (nbytes != msg_len) {
+        printf("smbbroker: Failed to send acknowledge to %s:%d\n", inet_ntoa(sub->sub_addr), sub->port);
+    } else {
+        printf("smbbroker: Acknowledge send to %s:%d\n", inet_ntoa(sub->sub_addr), sub->port);
+    }
+}
+
+/**
+ * Handles all pending requests on the control socket (up to CONTROL_BATCH) without blocking.
+ *
+ * @param control_fd The control socket
+ */
+void handle_control_requests(int control_fd) {
+    char rcv_buf[MSG_BUF_SIZE];
+    struct sockaddr_in client_addr;
+    socklen_t addr_length;
+    ssize_t nbytes;
+
+    for (int i = 0; i < CONTROL_BATCH; ++i) {
         memset(&client_addr, 0, sizeof(client_addr));
-        nbytes = recvfrom(broker_fd, rcv_buf, sizeof(rcv_buf), 0, (struct sockaddr *) &client_addr, &addr_length);
+        addr_length = sizeof(client_addr);
+        nbytes = recvfrom(control_fd, rcv_buf, sizeof(rcv_buf) - 1, MSG_DONTWAIT, (struct sockaddr *) &client_addr, &addr_length);
         if (nbytes == -1) {
-            perror("recvfrom");
-            continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvfrom control");
+            return;
         }
         rcv_buf[nbytes] = '\0';
 
-        cmd = rcv_buf[0];
-        msg_ptr = &rcv_buf[1];
-
-        switch (cmd) {
-            case SUB: { // SUBSCRIPTION request
-                struct subscription *sub;
-                uint8_t exists = 0;
-
-                // Go through the subscription list to check if the client of current request already is in the list.
-                for (int i = 0; i < sub_c; ++i) {
-                    sub = &sub_list[i];
-                    if (sub->sub_addr.s_addr == client_addr.sin_addr.s_addr && sub->port == ntohs(client_addr.sin_port)) {
-                        exists = 1;
-                        break;
-                    }
-                }
+        if (rcv_buf[0] == SUB) {
+            handle_subscribe(control_fd, &rcv_buf[1], &client_addr);
+        } else {
+            printf("smbbroker: Received unknown command on control port: %c\n", rcv_buf[0]);
+        }
+    }
+}
 
-                // If the client is not in the list, add it.
-                if (!exists) {
-                    sub = &sub_list[sub_c++];
-                    sub->sub_addr = client_addr.sin_addr;
-                    sub->port = ntohs(client_addr.sin_port);
-
-                    topic = msg_ptr;
-                    if (!(subtopic = spilt_at(msg_ptr, TOPIC_SEPARATOR))) {
-                        subtopic = "#";
-                    }
-
-                    snprintf(sub->topic, sizeof(sub->topic), "%s", topic);
-                    snprintf(sub->subtopic, sizeof(sub->subtopic), "%s", subtopic);
-                    printf("smbbroker: Topic '%s%c%s' added to subscription list for new subscriber %s:%d\n", msg_ptr, TOPIC_SEPARATOR, subtopic, inet_ntoa(sub->sub_addr), sub->port);
-                } else {
-                    printf("smbbroker: Subscriber %s:%d already in subscription list with topic '%s%c%s'. Sending acknowledge again...\n", inet_ntoa(sub->sub_addr), sub->port, sub->topic, TOPIC_SEPARATOR, sub->subtopic);
-                }
+/**
+ * Returns the memory a publish request takes up in its queue.
+ *
+ * @param req The publish request
+ * @return The size in bytes
+ */
+size_t publish_request_size(struct publish_request *req) {
+    return sizeof(*req) + req->len + 1;
+}
 
-                // In any case, we send an acknowledgement message to the client.
-                snprintf(send_buf, sizeof(send_buf), "%c%s%c%s", ACK, sub->topic, TOPIC_SEPARATOR, sub->subtopic);
-                msg_len = strlen(send_buf);
-
-                nbytes = sendto(broker_fd, send_buf, strlen(send_buf), 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                if (nbytes == -1) {
-                    perror("smbbroker: sendto acknowledge");
-                } else if (nbytes != msg_len) {
-                    printf("smbbroker: Failed to send acknowledge to %s:%d\n", inet_ntoa(sub->sub_addr), sub->port);
-                } else {
-                    printf("smbbroker: Acknowledge send to %s:%d\n", inet_ntoa(sub->sub_addr), sub->port);
-                }
+/**
+ * Removes the oldest publish request from a queue.
+ *
+ * @param queue The queue, must not be empty
+ * @return The removed request, which has to be freed by the caller
+ */
+struct publish_request *dequeue_publish_request(struct publish_queue *queue) {
+    struct publish_request *req = queue->head;
+
+    queue->head = req->next;
+    if (!queue->head) queue->tail = NULL;
+    queue->count--;
+    queued_bytes -= publish_request_size(req);
+    return req;
+}
+
+/**
+ * Drops a publish request and reports the number of dropped requests of its class every DROP_REPORT_INTERVAL.
+ *
+ * @param req The publish request, which is freed
+ * @param prio_class The priority class of the request
+ */
+void drop_publish_request(struct publish_request *req, int prio_class) {
+    struct publish_queue *queue = &publish_queues[prio_class];
+
+    if (queue->dropped++ % DROP_REPORT_INTERVAL == 0) {
+        printf("smbbroker: Max queue size reached. Dropped publish request on topic '%s%c%s' of priority class %d (%lu dropped in total)\n",
+               req->topic, TOPIC_SEPARATOR, req->subtopic, prio_class, queue->dropped);
+    }
+    free(req);
+}
+
+/**
+ * Appends a publish request to the queue of its priority class. If the pending requests would take up more than
+ * MAX_QUEUED_BYTES, the oldest requests of the lowest priority class that isn't higher than the new request's class
+ * are dropped first. If only higher classes are pending, the new request is dropped instead.
+ * This way a flood of a low class never delays or drops requests of higher classes.
+ *
+ * @param req The publish request, which is freed once it was relayed or dropped
+ */
+void enqueue_publish_request(struct publish_request *req) {
+    int prio_class = get_prio_class(req->topic, req->subtopic);
+    struct publish_queue *queue = &publish_queues[prio_class];
+    size_t size = publish_request_size(req);
+
+    while (queued_bytes + size > MAX_QUEUED_BYTES) {
+        int c = NUM_PRIO_CLASSES - 1;
+        while (c > prio_class && !publish_queues[c].head) c--;
+
+        if (!publish_queues[c].head) {
+            drop_publish_request(req, prio_class);
+            return;
+        }
+        drop_publish_request(dequeue_publish_request(&publish_queues[c]), c);
+    }
+
+    req->next = NULL;
+    if (queue->tail) {
+        queue->tail->next = req;
+    } else {
+        queue->head = req;
+    }
+    queue->tail = req;
+    queue->count++;
+    queued_bytes += size;
+}
+
+/**
+ * Reads all pending requests on the data socket (up to INGEST_BATCH) without blocking. Publish requests are queued
+ * according to their priority class, subscribe requests are handled immediately.
+ * The socket is always read, no matter how many requests are pending, so requests of higher classes never wait in
+ * the socket buffer behind requests of lower classes. Limiting the pending requests is up to enqueue_publish_request.
+ *
+ * @param data_fd The data socket
+ */
+void ingest_data_requests(int data_fd) {
+    static char rcv_buf[MSG_BUF_SIZE];
+    char control_buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct sockaddr_in src_addr;
+    struct timespec rx_ts;
+    struct publish_request *req;
+    struct cmsghdr *cmsg;
+    struct msghdr hdr;
+    struct iovec iov;
+    ssize_t nbytes;
+
+    for (int i = 0; i < INGEST_BATCH; ++i) {
+        memset(&src_addr, 0, sizeof(src_addr));
+        memset(&rx_ts, 0, sizeof(rx_ts));
+
+        iov.iov_base = rcv_buf;
+        iov.iov_len = sizeof(rcv_buf) - 1;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &src_addr;
+        hdr.msg_namelen = sizeof(src_addr);
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control_buf;
+        hdr.msg_controllen = sizeof(control_buf);
+
+        nbytes = recvmsg(data_fd, &hdr, MSG_DONTWAIT);
+        if (nbytes == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("recvmsg");
+            return;
+        }
+        rcv_buf[nbytes] = '\0';
+
+        for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                // ts[0] holds the software timestamp, ts[2] the raw hardware timestamp (not comparable with the system clock)
+                memcpy(&rx_ts, &((struct scm_timestamping *) CMSG_DATA(cmsg))->ts[0], sizeof(rx_ts));
+            }
+        }
+
+        switch (rcv_buf[0]) {
+            case SUB: { // SUBSCRIPTION request sent to the data port by a client without control port support
+                handle_subscribe(data_fd, &rcv_buf[1], &src_addr);
                 break;
             }
             case SOH: { // PUBLISH request
-                char *msg;
-                topic = msg_ptr;
-                msg = spilt_at(msg_ptr, STX);
-                subtopic = spilt_at(topic, TOPIC_SEPARATOR);
-
-                printf("smbbroker: Received publish request for message '%s' on topic '%s%c%s' from %s:%d\n", msg, topic, TOPIC_SEPARATOR, subtopic, inet_ntoa(client_addr.sin_addr),
-                       ntohs(client_addr.sin_port));
-
-                // Go through the subscription list...
-                for (int s = 0; s < sub_c; ++s) {
-                    struct subscription *sub = &sub_list[s];
-
-                    // ...and check if the topic matches the topic of the PUBLISH request (or is the wildcard).
-                    if (strcmp(sub->topic, topic) == 0 || strcmp(sub->topic, WILD_CARD) == 0) {
-                        // Check if it also matches the subtopic (or is the wildcard).
-                        if (strcmp(sub->subtopic, subtopic) == 0 || strcmp(sub->subtopic, WILD_CARD) == 0) {
-                            // If both matches, we relay the message to the corresponding client.
-                            memset(&client_addr, 0, sizeof(client_addr));
-                            client_addr.sin_family = AF_INET;
-                            client_addr.sin_addr = sub->sub_addr;
-                            client_addr.sin_port = htons(sub->port);
-
-                            printf("smbbroker: Relaying message '%s' on topic '%s%c%s' to %s:%d\n", msg, topic, TOPIC_SEPARATOR, subtopic, inet_ntoa(sub->sub_addr), sub->port);
-                            snprintf(send_buf, sizeof(send_buf), "%c%s%c%s%c%s", SOH, topic, TOPIC_SEPARATOR, subtopic, STX, msg);
-                            msg_len = strlen(send_buf);
-                            nbytes = sendto(broker_fd, send_buf, msg_len, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                            if (nbytes == -1) {
-                                perror("smbbroker: sendto");
-                            } else if (nbytes != msg_len) {
-                                printf("smbbroker: Failed to relay message '%s' on topic '%s%c%s' to %s:%d\n", msg, topic, TOPIC_SEPARATOR, subtopic, inet_ntoa(sub->sub_addr), sub->port);
-                            }
-                        }
-                    }
+                req = malloc(sizeof(*req) + nbytes + 1);
+                if (!req) {
+                    perror("smbbroker: Failed to allocate publish request");
+                    break;
+                }
+                req->src_addr = src_addr;
+                req->rx_ts = rx_ts;
+                req->len = nbytes;
+                memcpy(req->buf, rcv_buf, nbytes + 1);
+
+                req->topic = &req->buf[1];
+                req->msg = spilt_at(req->topic, STX);
+                req->subtopic = spilt_at(req->topic, TOPIC_SEPARATOR);
+                if (!req->msg || !req->subtopic) {
+                    printf("smbbroker: Received malformed publish request from %s:%d\n", inet_ntoa(src_addr.sin_addr),
+                           ntohs(src_addr.sin_port));
+                    free(req);
+                    break;
                 }
+
+                enqueue_publish_request(req);
                 break;
             }
             default: {
-                printf("smbbroker: Received unknown command: %c\n", cmd);
+                printf("smbbroker: Received unknown command: %c\n", rcv_buf[0]);
                 break;
             }
         }
     }
 }
+
+/**
+ * Relays a publish request to all subscribers with a matching topic and subtopic.
+ *
+ * @param data_fd The socket to relay from
+ * @param req The publish request
+ */
+void relay(int data_fd, struct publish_request *req) {
+    char send_buf[MSG_BUF_SIZE];
+    struct sockaddr_in client_addr;
+    uint32_t msg_len;
+    ssize_t nbytes;
+    int64_t dwell;
+
+    if (!low_latency) {
+        printf("smbbroker: Received publish request for message '%s' on topic '%s%c%s' from %s:%d\n", req->msg, req->topic, TOPIC_SEPARATOR, req->subtopic,
+               inet_ntoa(req->src_addr.sin_addr), ntohs(req->src_addr.sin_port));
+    }
+
+    snprintf(send_buf, sizeof(send_buf), "%c%s%c%s%c%s", SOH, req->topic, TOPIC_SEPARATOR, req->subtopic, STX, req->msg);
+    msg_len = strlen(send_buf);
+
+    // Go through the subscription list...
+    for (int s = 0; s < sub_c; ++s) {
+        struct subscription *sub = &sub_list[s];
+
+        // ...and check if topic and subtopic match the PUBLISH request (or are the wildcard).
+        if (topic_matches(sub->topic, req->topic) && topic_matches(sub->subtopic, req->subtopic)) {
+            // If both matches, we relay the message to the corresponding client.
+            memset(&client_addr, 0, sizeof(client_addr));
+            client_addr.sin_family = AF_INET;
+            client_addr.sin_addr = sub->sub_addr;
+            client_addr.sin_port = htons(sub->port);
+
+            if (!low_latency) {
+                printf("smbbroker: Relaying message '%s' on topic '%s%c%s' to %s:%d\n", req->msg, req->topic, TOPIC_SEPARATOR, req->subtopic, inet_ntoa(sub->sub_addr), sub->port);
+            }
+            nbytes = sendto(data_fd, send_buf, msg_len, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
+            if (nbytes == -1) {
+                perror("smbbroker: sendto");
+            } else if (nbytes != msg_len) {
+                printf("smbbroker: Failed to relay message '%s' on topic '%s%c%s' to %s:%d\n", req->msg, req->topic, TOPIC_SEPARATOR, req->subtopic, inet_ntoa(sub->sub_addr), sub->port);
+            }
+        }
+    }
+
+    dwell = record_dwell(req);
+    if (!low_latency && dwell >= 0) {
+        printf("smbbroker: Message on topic '%s%c%s' spent %" PRId64 " ns in the broker\n", req->topic, TOPIC_SEPARATOR, req->subtopic, dwell);
+    }
+}
+
+/**
+ * Relays up to max publish requests from the head of a queue.
+ *
+ * @param data_fd The socket to relay from
+ * @param queue The queue to serve
+ * @param max The max number of requests to relay
+ * @return The number of relayed requests
+ */
+int serve_publish_queue(int data_fd, struct publish_queue *queue, int max) {
+    int n;
+
+    for (n = 0; n < max && queue->head; ++n) {
+        struct publish_request *req = dequeue_publish_request(queue);
+        relay(data_fd, req);
+        free(req);
+    }
+
+    return n;
+}
+
+/**
+ * Runs a single weighted round over the publish queues, serving higher priority classes first.
+ *
+ * @param data_fd The socket to relay from
+ * @return The number of publish requests still pending after the round
+ */
+unsigned int serve_publish_queues(int data_fd) {
+    unsigned int pending = 0;
+    int budget = ROUND_BUDGET;
+
+    // First every class gets its share...
+    for (int c = 0; c < NUM_PRIO_CLASSES; ++c) {
+        budget -= serve_publish_queue(data_fd, &publish_queues[c], class_weights[c]);
+    }
+
+    // ...then the unused shares go to the classes that still have requests queued, again higher classes first.
+    for (int c = 0; c < NUM_PRIO_CLASSES; ++c) {
+        budget -= serve_publish_queue(data_fd, &publish_queues[c], budget);
+        pending += publish_queues[c].count;
+    }
+
+    return pending;
+}
+
+int main(int argc, char *argv[]) {
+    struct pollfd fds[2];
+    unsigned int pending = 0;
+    int data_fd, control_fd;
+
+    validate_args(argc, argv);
+
+    // Create broker sockets
+    data_fd = create_socket(SERVER_PORT);
+    control_fd = create_socket(CONTROL_PORT);
+    enable_rx_timestamps(data_fd);
+
+    // A larger socket buffer absorbs bursts the broker can't read fast enough. Since the broker always reads the
+    // socket, requests only wait there while it is busy and not behind pending requests of lower classes.
+    int rcv_buf_size = DATA_RCV_BUF_SIZE;
+    if (setsockopt(data_fd, SOL_SOCKET, SO_RCVBUF, &rcv_buf_size, sizeof(rcv_buf_size)) < 0) {
+        perror("smbbroker: Warning: Failed to enlarge socket buffer");
+    }
+
+    printf("smbbroker: Listening on port %d (control port %d)\n", SERVER_PORT, CONTROL_PORT);
+    for (int r = 0; r < rule_c; ++r) {
+        printf("smbbroker: Topic '%s%c%s' has priority class %d\n", prio_rules[r].topic, TOPIC_SEPARATOR, prio_rules[r].subtopic, prio_rules[r].prio_class);
+    }
+    setup_low_latency();
+
+    fds[0].fd = control_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = data_fd;
+    fds[1].events = POLLIN;
+
+    while(low_latency) { // Spin on both sockets without ever blocking...
+        handle_control_requests(control_fd);
+        ingest_data_requests(data_fd);
+        pending = serve_publish_queues(data_fd);
+
+        if (!pending && dwell_c >= DWELL_SAMPLES) report_dwell();
+    }
+
+    while(1) { // Continuously listen for subscribing or publish requests...
+        // Only block if there is nothing left to relay, otherwise just check for new requests.
+        if (poll(fds, 2, pending ? 0 : -1) == -1) {
+            if (errno != EINTR) perror("poll");
+            continue;
+        }
+
+        // Control requests are always handled first so subscribers don't wait behind queued publish requests.
+        if (fds[0].revents & POLLIN) handle_control_requests(control_fd);
+        if (fds[1].revents & POLLIN) ingest_data_requests(data_fd);
+
+        pending = serve_publish_queues(data_fd);
+
+        if (!pending && dwell_c >= DWELL_SAMPLES) report_dwell();
+    }
+}
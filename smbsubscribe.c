@@ -11,6 +11,7 @@
 #include <errno.h>
 
 #define SERVER_PORT 8080
+#define CONTROL_PORT 8081       // Dedicated broker port for SUBSCRIBE requests and their acknowledgements
 #define MSG_BUF_SIZE 4096
 #define MAX_TOPIC_LEN 512
 #define ACK 'A'                 // Used as the start of an ACKNOWLEDGE message
@@ -67,6 +68,31 @@ struct sockaddr_in* resolve_hostname(char *hostname) {
     return (struct sockaddr_in *) res->ai_addr;
 }
 
+/**
+ * Receives a message from the broker and discards messages from any other address or port.
+ * Acknowledgements arrive from the control port while relayed messages arrive from the data port,
+ * so the socket can't be connected to a single broker port.
+ *
+ * @param fd The socket to receive from
+ * @param buf The buffer to receive into
+ * @param len The size of the buffer
+ * @param broker_ip The IP address of the broker
+ * @return The number of bytes received or -1 on error
+ */
+ssize_t recv_from_broker(int fd, char *buf, size_t len, struct in_addr broker_ip) {
+    struct sockaddr_in src_addr;
+    socklen_t addr_length;
+    ssize_t nbytes;
+
+    do {
+        addr_length = sizeof(src_addr);
+        nbytes = recvfrom(fd, buf, len, 0, (struct sockaddr *) &src_addr, &addr_length);
+    } while (nbytes != -1 && (src_addr.sin_addr.s_addr != broker_ip.s_addr
+                              || (src_addr.sin_port != htons(SERVER_PORT) && src_addr.sin_port != htons(CONTROL_PORT))));
+
+    return nbytes;
+}
+
 /**
  * Checks the args for validity and saves them in the corresponding variables.
  */
@@ -116,14 +142,14 @@ int main(int argc, char *argv[]) {
     char cmd, *topic, *subtopic, *msg;
     struct sockaddr_in *broker_addr;
     struct timeval tv;
-    int broker_fd, errcode;
+    int broker_fd;
     uint addr_length;
     ssize_t nbytes;
 
     validate_args(argc, argv, &hostname, &topic, &subtopic);
 
     broker_addr = resolve_hostname(hostname);
-    broker_addr->sin_port = htons(SERVER_PORT);
+    broker_addr->sin_port = htons(CONTROL_PORT);
     addr_length = sizeof(*broker_addr);
 
     // Create UDP socket
@@ -133,13 +159,6 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    // Set the default address to send to and the only address to receive from
-    errcode = connect(broker_fd, (const struct sockaddr *) broker_addr, addr_length);
-    if (errcode < 0) {
-        perror("Error connecting to server");
-        return EXIT_FAILURE;
-    }
-
     // Set socket to timeout after TIMEOUT_SECS when not receiving an acknowledgment from the broker
     tv.tv_sec = TIMEOUT_SECS;
     tv.tv_usec = 0;
@@ -154,12 +173,12 @@ int main(int argc, char *argv[]) {
     do {
         // Send subscription message until broker acknowledges it to make sure the subscription was added to the broker
 
-        nbytes = send(broker_fd, buf, strlen(buf), 0);
+        nbytes = sendto(broker_fd, buf, strlen(buf), 0, (const struct sockaddr *) broker_addr, addr_length);
         if (nbytes == -1) {
             perror("send sub request");
             return EXIT_FAILURE;
         }
-        nbytes = recv(broker_fd, buf, sizeof(buf), 0);
+        nbytes = recv_from_broker(broker_fd, buf, sizeof(buf) - 1, broker_addr->sin_addr);
         if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) { // If recv timed out...
             puts("Didn't receive an acknowledge from the broker. Sending request again...");
         } else if (nbytes == -1) {
@@ -202,7 +221,7 @@ int main(int argc, char *argv[]) {
     setsockopt(broker_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
 
     while (1) { // Listen for messages continuously...
-        nbytes = recv(broker_fd, buf, sizeof(buf), 0);
+        nbytes = recv_from_broker(broker_fd, buf, sizeof(buf) - 1, broker_addr->sin_addr);
         if (nbytes == -1) {
             perror("recv msg");
         } else {